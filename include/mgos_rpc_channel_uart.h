@@ -19,6 +19,9 @@
 #define CS_FW_SRC_MGOS_MG_RPC_CHANNEL_UART_H_
 
 #include <stdbool.h>
+#include <stdint.h>
+
+#include "common/mbuf.h"
 
 #include "mg_rpc_channel.h"
 
@@ -29,6 +32,120 @@ extern "C" {
 struct mg_rpc_channel *mg_rpc_channel_uart(int uart_no,
                                            bool wait_for_start_frame);
 
+/*
+ * Byte transport that the channel's framing runs over. The UART one is
+ * used by mg_rpc_channel_uart(); others (SPI, pipes, sockets) can be
+ * plugged in with mg_rpc_channel_uart_with_transport().
+ * All callbacks receive the `tr_arg` the channel was created with.
+ */
+struct mg_rpc_channel_uart_transport {
+  const char *name;
+  /*
+   * Start delivering I/O events: from now on, the transport calls
+   * mg_rpc_channel_uart_dispatch(ch) when there is input to read or room
+   * for output, and soon after `schedule` is invoked.
+   */
+  void (*start)(void *tr_arg, struct mg_rpc_channel *ch);
+  void (*stop)(void *tr_arg);
+  size_t (*read_avail)(void *tr_arg);
+  /* Appends up to len bytes of input to mb, returns the number appended. */
+  size_t (*read)(void *tr_arg, struct mbuf *mb, size_t len);
+  size_t (*write_avail)(void *tr_arg);
+  size_t (*write)(void *tr_arg, const void *buf, size_t len);
+  /* Waits until all output has been sent. */
+  void (*flush)(void *tr_arg);
+  void (*schedule)(void *tr_arg);
+};
+
+struct mg_rpc_channel *mg_rpc_channel_uart_with_transport(
+    const struct mg_rpc_channel_uart_transport *tr, void *tr_arg,
+    bool wait_for_start_frame);
+
+/* Processes pending input and output, called by the transport. */
+void mg_rpc_channel_uart_dispatch(struct mg_rpc_channel *ch);
+
+/*
+ * Returns the time since the channel last received any bytes, in
+ * microseconds, or -1 if `ch` is not a channel created by this library.
+ * Can be used as a liveness indicator by code that manages several links,
+ * e.g. to switch to a standby one when this one stalls.
+ */
+int64_t mg_rpc_channel_uart_get_idle_micros(struct mg_rpc_channel *ch);
+
+/*
+ * Returns the channel created from the `rpc.uart` config, or NULL if it
+ * is disabled or failed to initialize.
+ */
+struct mg_rpc_channel *mgos_rpc_uart_get_channel(void);
+
+/*
+ * Sets the authenticated identity of the peer for the current session,
+ * e.g. after it has passed a challenge-response exchange once. Until the
+ * next handshake, until the channel is closed or until it receives nothing
+ * for 60 seconds, requests arriving on the channel are treated as coming
+ * from `username` without per-request auth.
+ * Pass NULL to drop the identity. Returns false if `ch` is not a channel
+ * created by this library or if out of memory.
+ */
+bool mg_rpc_channel_uart_set_authn_info(struct mg_rpc_channel *ch,
+                                        const char *username);
+
+/*
+ * Record types of the traffic capture returned by RPC.UART.GetCapture.
+ * Each record is a 7-byte header: type (1 byte), uptime in microseconds
+ * (lower 32 bits, little-endian), length (16 bits, little-endian).
+ * RX and TX records are followed by `length` bytes of raw data as read
+ * from or written to the transport. Frame records have no data: they mark
+ * the end of a received frame, or of a sent user frame, `length` bytes long.
+ */
+enum mg_rpc_channel_uart_cap_type {
+  MG_RPC_CHANNEL_UART_CAP_RX = 0,
+  MG_RPC_CHANNEL_UART_CAP_TX = 1,
+  MG_RPC_CHANNEL_UART_CAP_RX_FRAME = 2,
+  MG_RPC_CHANNEL_UART_CAP_TX_FRAME = 3,
+};
+
+/*
+ * CRC32 trailers on outgoing frames and verification of incoming ones.
+ * Disable only for links that are reliable by other means: peers will
+ * still accept frames without a CRC, and CRCs sent by peers are ignored.
+ */
+#ifndef MG_RPC_CHANNEL_UART_CRC
+#define MG_RPC_CHANNEL_UART_CRC 1
+#endif
+
+#ifndef MG_RPC_CHANNEL_UART_TRACE
+#define MG_RPC_CHANNEL_UART_TRACE 0
+#endif
+
+#if MG_RPC_CHANNEL_UART_TRACE
+#include "frozen.h"
+
+#ifndef MG_RPC_CHANNEL_UART_TRACE_SIZE
+#define MG_RPC_CHANNEL_UART_TRACE_SIZE 128
+#endif
+
+enum mg_rpc_channel_uart_trace_ev_type {
+  MG_RPC_CHANNEL_UART_TRACE_RX_CHUNK = 0,
+  MG_RPC_CHANNEL_UART_TRACE_FRAME_FOUND = 1,
+  MG_RPC_CHANNEL_UART_TRACE_CRC_OK = 2,
+  MG_RPC_CHANNEL_UART_TRACE_CRC_FAIL = 3,
+  MG_RPC_CHANNEL_UART_TRACE_HANDLER_ENTER = 4,
+  MG_RPC_CHANNEL_UART_TRACE_HANDLER_EXIT = 5,
+  MG_RPC_CHANNEL_UART_TRACE_TX_CHUNK = 6,
+  MG_RPC_CHANNEL_UART_TRACE_TX_FIFO_EMPTY = 7,
+  MG_RPC_CHANNEL_UART_TRACE_LOG_SUSPEND = 8,
+  MG_RPC_CHANNEL_UART_TRACE_LOG_RESUME = 9,
+};
+
+/*
+ * Prints the recorded trace events to `out` as a Chrome trace JSON array
+ * (load it in chrome://tracing) and resets the ring. Returns the number of
+ * bytes printed. Also available as RPC.UART.GetTrace.
+ */
+int mg_rpc_channel_uart_trace_dump(struct json_out *out);
+#endif /* MG_RPC_CHANNEL_UART_TRACE */
+
 #ifdef __cplusplus
 }
 #endif /* __cplusplus */
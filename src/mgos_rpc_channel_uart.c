@@ -21,6 +21,8 @@
 
 #include "mgos_debug.h"
 #include "mgos_sys_config.h"
+#include "mgos_time.h"
+#include "mgos_timers.h"
 #include "mgos_uart.h"
 #include "mgos_utils.h"
 
@@ -29,22 +31,524 @@
 #include "common/mbuf.h"
 #include "common/str_util.h"
 
+#include "frozen.h"
+
 #define EOF_CHAR "\x04"
+#define PROBE_CHAR '\x05'
+#define PROBE_REPLY_CHAR "\x06"
 #define FRAME_DELIMETER "\"\"\""
 #define FRAME_DELIMETER_LEN 3
+#if MG_RPC_CHANNEL_UART_CRC
+#define FRAME_CRC_LEN 8
+#else
+#define FRAME_CRC_LEN 0
+#endif
+/*
+ * Buffers are shrunk back to BUF_LOW_WATERMARK once they grow beyond
+ * the high watermark and become empty, and released completely after
+ * BUF_IDLE_MS of no traffic. In between, capacity is kept for reuse.
+ * The high watermark is twice the largest frame (see rpc.max_frame_size),
+ * so that traffic within the limits never causes a shrink/grow cycle.
+ * Capacity reserved with rpc.uart.{recv,send}_buf_size is never released.
+ */
+#define BUF_LOW_WATERMARK 256
+#define BUF_IDLE_MS 10000
+/*
+ * After RPC.UART.Configure, new settings are reverted unless a valid frame
+ * is received with them within this time.
+ */
+#define RECONFIG_CONFIRM_MS 5000
+#define RECONFIG_MIN_BAUD_RATE 300
+#define RECONFIG_MAX_BAUD_RATE 5000000
+/* Traffic capture record header: type, timestamp (32 bits), length. */
+#define CAPTURE_HDR_LEN 7
+/* Chunks logged at verbose level are truncated to this many bytes. */
+#define LOG_CHUNK_MAX 64
+/* Session identity is dropped after the link has been silent this long. */
+#define AUTHN_IDLE_MICROS 60000000
+/* Don't answer handshakes more often than this. */
+#define HANDSHAKE_REPLY_INTERVAL_MICROS 100000
+
+/* Control frames are sent as is, straight from here. */
+static const char s_handshake_reply[] =
+    FRAME_DELIMETER EOF_CHAR FRAME_DELIMETER;
+
+struct mg_rpc_channel_uart_stats {
+  unsigned int rx_bytes;
+  unsigned int tx_bytes;
+  unsigned int rx_frames;
+  unsigned int tx_frames;
+  unsigned int rx_crc_errors;
+  int64_t last_rx_micros;
+  unsigned int alloc_failures;
+  unsigned int rx_drops;
+  unsigned int rx_buf_peak;
+  unsigned int tx_buf_peak;
+  unsigned int max_dispatch_micros;
+};
+
+/* Ring of capture records, oldest ones are dropped to make room. */
+struct mg_rpc_channel_uart_capture {
+  uint8_t *buf;
+  size_t size;
+  size_t start;
+  size_t len;
+};
 
 struct mg_rpc_channel_uart_data {
-  int uart_no;
+  int uart_no; /* -1 if the transport is not a UART. */
+  const struct mg_rpc_channel_uart_transport *tr;
+  void *tr_arg;
   unsigned int wait_for_start_frame : 1;
   unsigned int waiting_for_start_frame : 1;
   unsigned int connected : 1;
   unsigned int sending : 1;
   unsigned int sending_user_frame : 1;
   unsigned int resume_uart : 1;
+  /* RPC.UART.Configure was called, its response hasn't been sent yet. */
+  unsigned int reconfig_wait_response : 1;
+  /* The frame being sent is the response, apply new settings after it. */
+  unsigned int reconfig_on_sent : 1;
+  unsigned int rx_pending : 1; /* recv_mbuf may hold more complete frames. */
+  /* A frame could not be buffered, its FRAME_SENT failure is pending. */
+  unsigned int user_frame_dropped : 1;
+  int max_frames_per_dispatch; /* 0 - no limit. */
+  int64_t last_handshake_reply_micros;
   struct mbuf recv_mbuf;
   struct mbuf send_mbuf;
+  size_t recv_buf_min_size;
+  size_t send_buf_min_size;
+  size_t send_off; /* Bytes of send_mbuf already written to the UART. */
+  size_t frame_end; /* End of the send_mbuf frame being written. */
+  size_t user_frame_len;
+  size_t user_frame_end; /* Offset of the user frame end in send_mbuf. */
+  /* Constant control frame being sent, goes out between send_mbuf frames. */
+  const char *ctl_frame;
+  size_t ctl_len;
+  size_t ctl_off;
+  struct mg_rpc_channel_uart_stats stats;
+  int64_t reconfig_id; /* Id of the RPC.UART.Configure request. */
+  struct mgos_uart_config new_cfg;
+  struct mgos_uart_config old_cfg;
+  mgos_timer_id reconfig_timer_id; /* Reverts to old_cfg when it fires. */
+  int64_t last_activity_micros;
+  mgos_timer_id idle_timer_id;
+  char *authn_username;
+  struct mg_rpc_channel_uart_capture cap;
+};
+
+#if MG_RPC_CHANNEL_UART_TRACE
+struct mg_rpc_channel_uart_trace_ev {
+  uint32_t ts;
+  uint16_t type;
+  uint16_t arg;
+};
+
+static const char *const s_trace_ev_names[] = {
+    "rx_chunk",      "frame_found",   "crc_ok",       "crc_fail",
+    "handler_enter", "handler_exit",  "tx_chunk",     "tx_fifo_empty",
+    "log_suspend",   "log_resume",
 };
 
+static struct mg_rpc_channel_uart_trace_ev
+    s_trace[MG_RPC_CHANNEL_UART_TRACE_SIZE];
+static unsigned int s_trace_idx;
+
+static void mg_rpc_channel_uart_trace(enum mg_rpc_channel_uart_trace_ev_type t,
+                                      size_t arg) {
+  struct mg_rpc_channel_uart_trace_ev *ev =
+      &s_trace[s_trace_idx++ % MG_RPC_CHANNEL_UART_TRACE_SIZE];
+  ev->ts = (uint32_t) mgos_uptime_micros();
+  ev->type = t;
+  ev->arg = (uint16_t) MIN(arg, 0xffff);
+}
+
+int mg_rpc_channel_uart_trace_dump(struct json_out *out) {
+  int len = 0;
+  unsigned int i = 0, n = MIN(s_trace_idx, MG_RPC_CHANNEL_UART_TRACE_SIZE);
+  if (s_trace_idx > MG_RPC_CHANNEL_UART_TRACE_SIZE) {
+    i = s_trace_idx % MG_RPC_CHANNEL_UART_TRACE_SIZE;
+  }
+  len += json_printf(out, "[");
+  for (; n > 0; n--, i = (i + 1) % MG_RPC_CHANNEL_UART_TRACE_SIZE) {
+    const struct mg_rpc_channel_uart_trace_ev *ev = &s_trace[i];
+    len += json_printf(out,
+                       "{name: %Q, ph: %Q, s: %Q, pid: 0, tid: 0, ts: %u, "
+                       "args: {n: %u}}%s",
+                       s_trace_ev_names[ev->type], "i", "g",
+                       (unsigned int) ev->ts, (unsigned int) ev->arg,
+                       (n > 1 ? "," : ""));
+  }
+  len += json_printf(out, "]");
+  s_trace_idx = 0;
+  return len;
+}
+
+#define TRACE(t, arg) mg_rpc_channel_uart_trace(t, arg)
+#else
+#define TRACE(t, arg)
+#endif
+
+static bool mg_rpc_channel_uart_is_console(
+    const struct mg_rpc_channel_uart_data *chd) {
+  return (chd->uart_no >= 0 && (mgos_get_stdout_uart() == chd->uart_no ||
+                                mgos_get_stderr_uart() == chd->uart_no));
+}
+
+/* Keeps the console off the UART until the send buffer drains. */
+static void mg_rpc_channel_uart_suspend_console(
+    struct mg_rpc_channel_uart_data *chd) {
+  if (chd->resume_uart || !mg_rpc_channel_uart_is_console(chd)) return;
+  mgos_debug_suspend_uart();
+  TRACE(MG_RPC_CHANNEL_UART_TRACE_LOG_SUSPEND, 0);
+  chd->resume_uart = true;
+}
+
+/* Formats up to LOG_CHUNK_MAX bytes of data as hex into buf. */
+static const char *mg_rpc_channel_uart_hex(char *buf, const char *data,
+                                           size_t len) {
+  size_t i, n = MIN(len, LOG_CHUNK_MAX);
+  for (i = 0; i < n; i++) {
+    sprintf(buf + i * 2, "%02x", (unsigned char) data[i]);
+  }
+  strcpy(buf + n * 2, (len > n ? "..." : ""));
+  return buf;
+}
+
+static void mg_rpc_channel_uart_cap_put(struct mg_rpc_channel_uart_capture *c,
+                                        const void *data, size_t len) {
+  const uint8_t *p = (const uint8_t *) data;
+  size_t i, off = (c->start + c->len) % c->size;
+  for (i = 0; i < len; i++) {
+    c->buf[off] = p[i];
+    if (++off == c->size) off = 0;
+  }
+  c->len += len;
+}
+
+/*
+ * Appends a capture record. Chunk records carry the data, frame records
+ * (MG_RPC_CHANNEL_UART_CAP_*_FRAME) only the frame length.
+ */
+static void mg_rpc_channel_uart_capture(struct mg_rpc_channel_uart_data *chd,
+                                        enum mg_rpc_channel_uart_cap_type type,
+                                        const char *data, size_t len) {
+  struct mg_rpc_channel_uart_capture *c = &chd->cap;
+  uint8_t hdr[CAPTURE_HDR_LEN];
+  size_t dlen = (data != NULL ? len : 0);
+  if (c->size == 0) return;
+  len = MIN(len, 0xffff);
+  dlen = MIN(dlen, MIN(len, c->size - CAPTURE_HDR_LEN));
+  if (data != NULL) len = dlen;
+  while (c->len + CAPTURE_HDR_LEN + dlen > c->size) {
+    /* Drop the oldest record. */
+    size_t rec_len = CAPTURE_HDR_LEN;
+    uint8_t rtype = c->buf[c->start];
+    if (rtype == MG_RPC_CHANNEL_UART_CAP_RX ||
+        rtype == MG_RPC_CHANNEL_UART_CAP_TX) {
+      rec_len += c->buf[(c->start + 5) % c->size] |
+                 (c->buf[(c->start + 6) % c->size] << 8);
+    }
+    c->start = (c->start + rec_len) % c->size;
+    c->len -= rec_len;
+  }
+  uint32_t ts = (uint32_t) mgos_uptime_micros();
+  hdr[0] = type;
+  hdr[1] = ts & 0xff;
+  hdr[2] = (ts >> 8) & 0xff;
+  hdr[3] = (ts >> 16) & 0xff;
+  hdr[4] = (ts >> 24) & 0xff;
+  hdr[5] = len & 0xff;
+  hdr[6] = (len >> 8) & 0xff;
+  mg_rpc_channel_uart_cap_put(c, hdr, sizeof(hdr));
+  mg_rpc_channel_uart_cap_put(c, data, dlen);
+}
+
+/*
+ * Makes sure there is room for len more bytes in the buffer, so that the
+ * appends that follow cannot fail half-way through a frame.
+ */
+static bool mg_rpc_channel_uart_reserve(struct mg_rpc_channel_uart_data *chd,
+                                        struct mbuf *mb, size_t len) {
+  if (mb->size - mb->len >= len) return true;
+  if (mb == &chd->send_mbuf && chd->send_off > 0) {
+    /* Reclaim what has already been written before growing. */
+    mbuf_remove(mb, chd->send_off);
+    if (chd->sending_user_frame) chd->user_frame_end -= chd->send_off;
+    chd->frame_end -= chd->send_off;
+    chd->send_off = 0;
+    if (mb->size - mb->len >= len) return true;
+  }
+  /* Grow geometrically, fall back to the exact size if that fails. */
+  mbuf_resize(mb, MAX(mb->len + len, mb->size * 2));
+  if (mb->size - mb->len >= len) return true;
+  mbuf_resize(mb, mb->len + len);
+  if (mb->size - mb->len >= len) return true;
+  chd->stats.alloc_failures++;
+  return false;
+}
+
+/* Returns the end of the send_mbuf frame that starts at off. */
+static size_t mg_rpc_channel_uart_frame_end(const struct mbuf *mb,
+                                            size_t off) {
+  const char *end = NULL;
+  if (mb->len - off > FRAME_DELIMETER_LEN) {
+    end = c_strnstr(mb->buf + off + FRAME_DELIMETER_LEN, FRAME_DELIMETER,
+                    mb->len - off - FRAME_DELIMETER_LEN);
+  }
+  return (end != NULL ? (size_t)(end - mb->buf) + FRAME_DELIMETER_LEN
+                      : mb->len);
+}
+
+/*
+ * Called when the buffer has been drained. Gives memory back only if the
+ * buffer has grown past the high watermark, so that steady traffic keeps
+ * reusing the same allocation.
+ */
+static void mg_rpc_channel_uart_shrink(struct mbuf *mb, size_t min_size,
+                                       unsigned int *peak) {
+  size_t low = MAX(BUF_LOW_WATERMARK, min_size);
+  size_t high = 2 * ((size_t) mgos_sys_config_get_rpc_max_frame_size() +
+                     FRAME_CRC_LEN + 2 * FRAME_DELIMETER_LEN);
+  if (mb->size > *peak) *peak = mb->size;
+  if (mb->size > MAX(high, min_size) && mb->len <= low) {
+    mbuf_resize(mb, low);
+  }
+}
+
+static void mg_rpc_channel_uart_idle_timer_cb(void *arg) {
+  struct mg_rpc_channel_uart_data *chd =
+      (struct mg_rpc_channel_uart_data *) arg;
+  if (mgos_uptime_micros() - chd->last_activity_micros <
+      BUF_IDLE_MS * 1000LL) {
+    return;
+  }
+  if (chd->recv_mbuf.len == 0 &&
+      chd->recv_mbuf.size > chd->recv_buf_min_size) {
+    mbuf_resize(&chd->recv_mbuf, chd->recv_buf_min_size);
+  }
+  if (chd->send_mbuf.len == 0 &&
+      chd->send_mbuf.size > chd->send_buf_min_size) {
+    mbuf_resize(&chd->send_mbuf, chd->send_buf_min_size);
+  }
+}
+
+#if MG_RPC_CHANNEL_UART_CRC
+/* Parses the hex CRC32 at the start of the frame metadata. */
+static bool mg_rpc_channel_uart_parse_crc(const struct mg_str meta,
+                                          uint32_t *crc) {
+  size_t i;
+  uint32_t v = 0;
+  for (i = 0; i < meta.len && i < 8; i++) {
+    char c = meta.p[i];
+    if (c >= '0' && c <= '9') {
+      v = (v << 4) | (uint32_t)(c - '0');
+    } else if (c >= 'a' && c <= 'f') {
+      v = (v << 4) | (uint32_t)(c - 'a' + 10);
+    } else if (c >= 'A' && c <= 'F') {
+      v = (v << 4) | (uint32_t)(c - 'A' + 10);
+    } else {
+      break;
+    }
+  }
+  *crc = v;
+  return (i > 0);
+}
+#endif
+
+static void mg_rpc_channel_uart_reconfig_revert_cb(void *arg) {
+  struct mg_rpc_channel_uart_data *chd =
+      (struct mg_rpc_channel_uart_data *) arg;
+  chd->reconfig_timer_id = MGOS_INVALID_TIMER_ID;
+  LOG(LL_WARN, ("UART%d: no valid frame with new settings, reverting",
+                chd->uart_no));
+  chd->tr->flush(chd->tr_arg);
+  mgos_uart_configure(chd->uart_no, &chd->old_cfg);
+}
+
+static void mg_rpc_channel_uart_reconfig_apply(
+    struct mg_rpc_channel_uart_data *chd) {
+  chd->tr->flush(chd->tr_arg);
+  if (!mgos_uart_configure(chd->uart_no, &chd->new_cfg)) {
+    LOG(LL_ERROR, ("UART%d reconfig failed", chd->uart_no));
+    mgos_uart_configure(chd->uart_no, &chd->old_cfg);
+    return;
+  }
+  chd->reconfig_timer_id =
+      mgos_set_timer(RECONFIG_CONFIRM_MS, 0,
+                     mg_rpc_channel_uart_reconfig_revert_cb, chd);
+}
+
+/* A valid frame has arrived, so the peer has switched too. */
+static void mg_rpc_channel_uart_reconfig_confirm(
+    struct mg_rpc_channel_uart_data *chd) {
+  if (chd->reconfig_timer_id == MGOS_INVALID_TIMER_ID) return;
+  mgos_clear_timer(chd->reconfig_timer_id);
+  chd->reconfig_timer_id = MGOS_INVALID_TIMER_ID;
+  LOG(LL_INFO, ("UART%d new settings confirmed", chd->uart_no));
+}
+
+static void mg_rpc_channel_uart_reconfig_cancel(
+    struct mg_rpc_channel_uart_data *chd) {
+  chd->reconfig_wait_response = chd->reconfig_on_sent = false;
+  mgos_clear_timer(chd->reconfig_timer_id);
+  chd->reconfig_timer_id = MGOS_INVALID_TIMER_ID;
+}
+
+/* Checks whether f is the response (not a request) with the given id. */
+static bool mg_rpc_channel_uart_is_response(const struct mg_str f,
+                                            int64_t id) {
+  int64_t fid = -1;
+  char *method = NULL;
+  json_scanf(f.p, f.len, "{id: %lld, method: %Q}", &fid, &method);
+  bool res = (fid == id && method == NULL);
+  free(method);
+  return res;
+}
+
+/* Handles one complete frame of f.len bytes sitting in recv_mbuf. */
+static void mg_rpc_channel_uart_handle_frame(struct mg_rpc_channel *ch,
+                                             struct mg_str f) {
+  struct mg_rpc_channel_uart_data *chd =
+      (struct mg_rpc_channel_uart_data *) ch->channel_data;
+  TRACE(MG_RPC_CHANNEL_UART_TRACE_FRAME_FOUND, f.len);
+  mg_rpc_channel_uart_capture(chd, MG_RPC_CHANNEL_UART_CAP_RX_FRAME, NULL,
+                              f.len);
+  /*
+   * EOF_CHAR is used to turn off interactive console. If the frame is
+   * just EOF_CHAR by itself, we'll immediately send a frame containing
+   * eof_char in response (since the frame isn't valid anyway);
+   * otherwise we'll handle the frame.
+   */
+  if (mg_vcmp(&f, EOF_CHAR) == 0) {
+    chd->waiting_for_start_frame = false;
+    mg_rpc_channel_uart_reconfig_confirm(chd);
+    /* Handshake starts a new session, forget the old identity. */
+    mg_rpc_channel_uart_set_authn_info(ch, NULL);
+    if (!chd->connected) {
+      chd->connected = true;
+      ch->ev_handler(ch, MG_RPC_CHANNEL_OPEN, NULL);
+    }
+    /*
+     * Hosts send handshakes continuously until they get a reply, so
+     * there may be many of them queued up. One reply is enough.
+     */
+    int64_t now = mgos_uptime_micros();
+    if (chd->ctl_frame == NULL &&
+        (chd->last_handshake_reply_micros == 0 ||
+         now - chd->last_handshake_reply_micros >=
+             HANDSHAKE_REPLY_INTERVAL_MICROS)) {
+      chd->ctl_frame = s_handshake_reply;
+      chd->ctl_len = sizeof(s_handshake_reply) - 1;
+      chd->last_handshake_reply_micros = now;
+      chd->sending = true;
+    }
+  } else if (f.p[0] == PROBE_CHAR) {
+    /*
+     * Link probe: echo the payload back right away, bypassing mg_rpc,
+     * so the host can measure the raw link RTT and throughput.
+     */
+    if (chd->connected &&
+        mg_rpc_channel_uart_reserve(chd, &chd->send_mbuf,
+                                    f.len + 2 * FRAME_DELIMETER_LEN)) {
+      mbuf_append(&chd->send_mbuf, FRAME_DELIMETER, FRAME_DELIMETER_LEN);
+      mbuf_append(&chd->send_mbuf, PROBE_REPLY_CHAR, 1);
+      mbuf_append(&chd->send_mbuf, f.p + 1, f.len - 1);
+      mbuf_append(&chd->send_mbuf, FRAME_DELIMETER, FRAME_DELIMETER_LEN);
+      chd->sending = true;
+      mg_rpc_channel_uart_suspend_console(chd);
+    }
+  } else {
+    /*
+     * Frame may be followed by metadata, which is a comma-separated
+     * list of values: CRC32 checksum as a hex number, optionally
+     * followed by "p" for priority frames (see deliver_priority).
+     * TODO(rojer): Make the checksum mandatory when updated mos has been
+     * out for a while (today is 2017/03/28).
+     */
+    struct mg_str meta = mg_mk_str_n(f.p + f.len, 0);
+    while (meta.p > f.p) {
+      if (*(meta.p - 1) == '}') break;
+      meta.p--;
+      f.len--;
+      meta.len++;
+    }
+#if MG_RPC_CHANNEL_UART_CRC
+    if (meta.len >= 8) {
+      uint32_t crc = cs_crc32(0, f.p, f.len);
+      uint32_t expected_crc = 0;
+      if (!mg_rpc_channel_uart_parse_crc(meta, &expected_crc) ||
+          crc != expected_crc) {
+        LOG(LL_WARN,
+            ("%p Corrupted frame (%d): '%.*s' '%.*s' %08x %08x", ch,
+             (int) f.len, (int) f.len, f.p, (int) meta.len, meta.p,
+             (unsigned int) expected_crc, (unsigned int) crc));
+        chd->stats.rx_crc_errors++;
+        TRACE(MG_RPC_CHANNEL_UART_TRACE_CRC_FAIL, f.len);
+        f.len = 0;
+      } else {
+        TRACE(MG_RPC_CHANNEL_UART_TRACE_CRC_OK, f.len);
+      }
+    }
+#endif
+    if (f.len > 0) {
+      mg_rpc_channel_uart_reconfig_confirm(chd);
+      chd->stats.rx_frames++;
+      TRACE(MG_RPC_CHANNEL_UART_TRACE_HANDLER_ENTER, f.len);
+      ch->ev_handler(ch, MG_RPC_CHANNEL_FRAME_RECD, &f);
+      TRACE(MG_RPC_CHANNEL_UART_TRACE_HANDLER_EXIT, f.len);
+    }
+  }
+}
+
+/*
+ * Returns true if the frame metadata has the priority flag: a "p" field in
+ * the comma-separated list that follows the JSON text.
+ */
+static bool mg_rpc_channel_uart_is_priority(struct mg_str f) {
+  const char *p = f.p + f.len;
+  while (p > f.p && *(p - 1) != '}') p--;
+  if (p == f.p) return false;
+  while (p < f.p + f.len) {
+    const char *fe = (const char *) memchr(p, ',', f.p + f.len - p);
+    if (fe == NULL) fe = f.p + f.len;
+    if (fe - p == 1 && *p == 'p') return true;
+    p = fe + 1;
+  }
+  return false;
+}
+
+/*
+ * Delivers priority frames queued in recv_mbuf ahead of the others and
+ * cuts them out of the buffer. These are not subject to the frame budget.
+ * The scan stops at a handshake: frames after it belong to a new session
+ * and must not be handled under the identity of the current one.
+ */
+static void mg_rpc_channel_uart_deliver_priority(struct mg_rpc_channel *ch) {
+  struct mg_rpc_channel_uart_data *chd =
+      (struct mg_rpc_channel_uart_data *) ch->channel_data;
+  struct mbuf *urxb = &chd->recv_mbuf;
+  size_t off = 0;
+  const char *end;
+  while (off < urxb->len &&
+         (end = c_strnstr(urxb->buf + off, FRAME_DELIMETER,
+                          urxb->len - off)) != NULL) {
+    size_t flen = end - (urxb->buf + off);
+    size_t seg_len = flen + FRAME_DELIMETER_LEN;
+    struct mg_str f = mg_mk_str_n(urxb->buf + off, flen);
+    if (mg_vcmp(&f, EOF_CHAR) == 0) break;
+    if (flen != 0 &&
+        mg_rpc_channel_uart_is_priority(mg_mk_str_n(urxb->buf + off, flen))) {
+      mg_rpc_channel_uart_handle_frame(ch, mg_mk_str_n(urxb->buf + off, flen));
+      memmove(urxb->buf + off, urxb->buf + off + seg_len,
+              urxb->len - off - seg_len);
+      urxb->len -= seg_len;
+    } else {
+      off += seg_len;
+    }
+  }
+}
+
 /*
  * mgos client expects the following sequence:
  *
@@ -65,111 +569,232 @@ struct mg_rpc_channel_uart_data {
  * Note that the user handler may call LOG, so it's important to keep
  * UART disabled during RPC callback execution.
  */
-void mg_rpc_channel_uart_dispatcher(int uart_no, void *arg) {
-  struct mg_rpc_channel *ch = (struct mg_rpc_channel *) arg;
+void mg_rpc_channel_uart_dispatch(struct mg_rpc_channel *ch) {
   struct mg_rpc_channel_uart_data *chd =
       (struct mg_rpc_channel_uart_data *) ch->channel_data;
-  size_t rx_av = mgos_uart_read_avail(uart_no);
-  if (rx_av > 0) {
+  const struct mg_rpc_channel_uart_transport *tr = chd->tr;
+  int64_t start = mgos_uptime_micros();
+  /*
+   * While a backlog of frames is pending, leave new input in the driver:
+   * once its buffer fills up, flow control throttles the peer.
+   */
+  size_t rx_av = (chd->rx_pending ? 0 : tr->read_avail(chd->tr_arg));
+  if (rx_av > 0 || chd->rx_pending) {
+    bool rx_more = false;
     size_t flen = 0;
+    int num_frames = 0;
+    char hex[LOG_CHUNK_MAX * 2 + 4];
     const char *end;
     struct mbuf *urxb = &chd->recv_mbuf;
 
-    mgos_uart_read_mbuf(uart_no, urxb, rx_av);
+    if (rx_av > 0) {
+      /* Never buffer more than the largest frame we accept. */
+      size_t max_len = mgos_sys_config_get_rpc_max_frame_size() +
+                       2 * FRAME_DELIMETER_LEN + 1;
+      size_t old_len = urxb->len;
+      size_t rlen = (old_len < max_len ? MIN(rx_av, max_len - old_len) : 0);
+      rx_more = (rlen < rx_av);
+      rlen = tr->read(chd->tr_arg, urxb, rlen);
+      if (chd->authn_username != NULL &&
+          start - chd->stats.last_rx_micros > AUTHN_IDLE_MICROS) {
+        /* Peer may have been replaced without a handshake. */
+        mg_rpc_channel_uart_set_authn_info(ch, NULL);
+      }
+      chd->stats.rx_bytes += rlen;
+      chd->stats.last_rx_micros = start;
+      TRACE(MG_RPC_CHANNEL_UART_TRACE_RX_CHUNK, rlen);
+      mg_rpc_channel_uart_capture(chd, MG_RPC_CHANNEL_UART_CAP_RX,
+                                  urxb->buf + old_len, rlen);
+      if (!mg_rpc_channel_uart_is_console(chd)) {
+        LOG(LL_VERBOSE_DEBUG,
+            ("%p RX %lld %d %s", ch, (long long) start, (int) rlen,
+             mg_rpc_channel_uart_hex(hex, urxb->buf + old_len, rlen)));
+      }
+    }
+    chd->rx_pending = false;
+    if (chd->connected) mg_rpc_channel_uart_deliver_priority(ch);
     while ((end = c_strnstr(urxb->buf, FRAME_DELIMETER, urxb->len)) != NULL) {
       flen = (end - urxb->buf);
+      if (flen != 0 && chd->max_frames_per_dispatch > 0 &&
+          num_frames >= chd->max_frames_per_dispatch) {
+        chd->rx_pending = true;
+        break;
+      }
       if (flen != 0) {
-        struct mg_str f = mg_mk_str_n((const char *) urxb->buf, flen);
-        /*
-         * EOF_CHAR is used to turn off interactive console. If the frame is
-         * just EOF_CHAR by itself, we'll immediately send a frame containing
-         * eof_char in response (since the frame isn't valid anyway);
-         * otherwise we'll handle the frame.
-         */
-        if (mg_vcmp(&f, EOF_CHAR) == 0) {
-          chd->waiting_for_start_frame = false;
-          if (!chd->connected) {
-            chd->connected = true;
-            ch->ev_handler(ch, MG_RPC_CHANNEL_OPEN, NULL);
-          }
-          mbuf_append(&chd->send_mbuf, FRAME_DELIMETER, FRAME_DELIMETER_LEN);
-          mbuf_append(&chd->send_mbuf, EOF_CHAR, 1);
-          mbuf_append(&chd->send_mbuf, FRAME_DELIMETER, FRAME_DELIMETER_LEN);
-          chd->sending = true;
-        } else {
-          /*
-           * Frame may be followed by metadata, which is a comma-separated
-           * list of values. Right now, only one field is epxected:
-           * CRC32 checksum as a hex number.
-           * TODO(rojer): Make it mandatory when updated mos has been out for
-           * a while (today is 2017/03/28).
-           */
-          struct mg_str meta = mg_mk_str_n(f.p + f.len, 0);
-          while (meta.p > f.p) {
-            if (*(meta.p - 1) == '}') break;
-            meta.p--;
-            f.len--;
-            meta.len++;
-          }
-          if (meta.len >= 8) {
-            ((char *) meta.p)[meta.len] =
-                '\0'; /* Stomps first char of the delimiter. */
-            uint32_t crc = cs_crc32(0, f.p, f.len);
-            uint32_t expected_crc = 0;
-            if (sscanf(meta.p, "%x", (int *) &expected_crc) != 1 ||
-                crc != expected_crc) {
-              LOG(LL_WARN,
-                  ("%p Corrupted frame (%d): '%.*s' '%.*s' %08x %08x", ch,
-                   (int) f.len, (int) f.len, f.p, (int) meta.len, meta.p,
-                   (unsigned int) expected_crc, (unsigned int) crc));
-              f.len = 0;
-            }
-          }
-          if (f.len > 0) {
-            ch->ev_handler(ch, MG_RPC_CHANNEL_FRAME_RECD, &f);
-          }
-        }
+        num_frames++;
+        mg_rpc_channel_uart_handle_frame(
+            ch, mg_mk_str_n((const char *) urxb->buf, flen));
       }
       mbuf_remove(urxb, flen + FRAME_DELIMETER_LEN);
     }
-    if ((int) urxb->len >
-        mgos_sys_config_get_rpc_max_frame_size() + 2 * FRAME_DELIMETER_LEN) {
-      LOG(LL_ERROR, ("Incoming frame is too big, dropping."));
-      mbuf_remove(urxb, urxb->len);
+    if (chd->rx_pending || rx_more) {
+      /* Out of budget or input left unread: let others run, continue later. */
+      tr->schedule(chd->tr_arg);
+    }
+    if (!chd->rx_pending) {
+      if ((int) urxb->len >
+          mgos_sys_config_get_rpc_max_frame_size() + 2 * FRAME_DELIMETER_LEN) {
+        LOG(LL_ERROR, ("Incoming frame is too big, dropping."));
+        chd->stats.rx_drops += urxb->len;
+        mbuf_remove(urxb, urxb->len);
+      }
+      if (chd->waiting_for_start_frame && urxb->len > FRAME_DELIMETER_LEN) {
+        mbuf_remove(urxb, urxb->len - FRAME_DELIMETER_LEN);
+      }
+    }
+    mg_rpc_channel_uart_shrink(urxb, chd->recv_buf_min_size,
+                               &chd->stats.rx_buf_peak);
+    chd->last_activity_micros = chd->stats.last_rx_micros;
+  }
+  if (chd->user_frame_dropped) {
+    chd->user_frame_dropped = false;
+    ch->ev_handler(ch, MG_RPC_CHANNEL_FRAME_SENT, (void *) 0);
+  }
+  size_t tx_av;
+  while (chd->sending && (tx_av = tr->write_avail(chd->tr_arg)) > 0) {
+    /*
+     * Write straight from the buffer and only advance the offset, instead
+     * of moving the rest of the frame down after every chunk.
+     * Frames are written one at a time, and a pending control frame goes
+     * out at the first boundary between them.
+     */
+    bool ctl = (chd->ctl_frame != NULL && chd->send_off == chd->frame_end);
+    bool user_frame_sent = false;
+    const char *data;
+    size_t len;
+    if (ctl) {
+      data = chd->ctl_frame + chd->ctl_off;
+      len = chd->ctl_len - chd->ctl_off;
+    } else {
+      if (chd->send_off == chd->frame_end) {
+        chd->frame_end =
+            mg_rpc_channel_uart_frame_end(&chd->send_mbuf, chd->send_off);
+      }
+      data = chd->send_mbuf.buf + chd->send_off;
+      len = chd->frame_end - chd->send_off;
+    }
+    len = tr->write(chd->tr_arg, data, MIN(len, tx_av));
+    mg_rpc_channel_uart_capture(chd, MG_RPC_CHANNEL_UART_CAP_TX, data, len);
+    if (!mg_rpc_channel_uart_is_console(chd)) {
+      char hex[LOG_CHUNK_MAX * 2 + 4];
+      LOG(LL_VERBOSE_DEBUG,
+          ("%p TX %lld %d %s", ch, (long long) mgos_uptime_micros(), (int) len,
+           mg_rpc_channel_uart_hex(hex, data, len)));
+    }
+    chd->stats.tx_bytes += len;
+    TRACE(MG_RPC_CHANNEL_UART_TRACE_TX_CHUNK, len);
+    if (ctl) {
+      chd->ctl_off += len;
+      if (chd->ctl_off == chd->ctl_len) {
+        chd->ctl_frame = NULL;
+        chd->ctl_off = 0;
+      }
+    } else {
+      chd->send_off += len;
+      user_frame_sent =
+          (chd->sending_user_frame && chd->send_off >= chd->user_frame_end);
+      if (chd->send_off == chd->send_mbuf.len) {
+        chd->send_mbuf.len = chd->send_off = chd->frame_end = 0;
+      }
     }
-    if (chd->waiting_for_start_frame && urxb->len > FRAME_DELIMETER_LEN) {
-      mbuf_remove(urxb, urxb->len - FRAME_DELIMETER_LEN);
+    if (len == 0) break;
+    if (user_frame_sent) {
+      /* Probe replies may still follow, the user frame itself is out. */
+      if (chd->reconfig_on_sent) {
+        /* The response to RPC.UART.Configure has gone out, apply it now. */
+        chd->reconfig_on_sent = false;
+        mg_rpc_channel_uart_reconfig_apply(chd);
+      }
+      chd->sending_user_frame = false;
+      chd->stats.tx_frames++;
+      mg_rpc_channel_uart_capture(chd, MG_RPC_CHANNEL_UART_CAP_TX_FRAME, NULL,
+                                  chd->user_frame_len);
+      ch->ev_handler(ch, MG_RPC_CHANNEL_FRAME_SENT, (void *) 1);
     }
-    mbuf_trim(urxb);
-  }
-  size_t tx_av = mgos_uart_write_avail(uart_no);
-  if (chd->sending && tx_av > 0) {
-    size_t len = MIN(chd->send_mbuf.len, tx_av);
-    len = mgos_uart_write(uart_no, chd->send_mbuf.buf, len);
-    mbuf_remove(&chd->send_mbuf, len);
-    if (chd->send_mbuf.len == 0) {
+    if (chd->ctl_frame == NULL && chd->send_mbuf.len == 0) {
       chd->sending = false;
+      TRACE(MG_RPC_CHANNEL_UART_TRACE_TX_FIFO_EMPTY, 0);
       if (chd->resume_uart) {
         chd->resume_uart = false;
-        mgos_uart_flush(uart_no);
+        tr->flush(chd->tr_arg);
         mgos_debug_resume_uart();
+        TRACE(MG_RPC_CHANNEL_UART_TRACE_LOG_RESUME, 0);
       }
-      if (chd->sending_user_frame) {
-        chd->sending_user_frame = false;
-        ch->ev_handler(ch, MG_RPC_CHANNEL_FRAME_SENT, (void *) 1);
-      }
-      mbuf_trim(&chd->send_mbuf);
+      mg_rpc_channel_uart_shrink(&chd->send_mbuf, chd->send_buf_min_size,
+                                 &chd->stats.tx_buf_peak);
+      chd->last_activity_micros = mgos_uptime_micros();
     }
   }
+  unsigned int took = (unsigned int) (mgos_uptime_micros() - start);
+  if (took > chd->stats.max_dispatch_micros) {
+    chd->stats.max_dispatch_micros = took;
+  }
+}
+
+void mg_rpc_channel_uart_dispatcher(int uart_no, void *arg) {
+  mg_rpc_channel_uart_dispatch((struct mg_rpc_channel *) arg);
+  (void) uart_no;
+}
+
+static void mg_rpc_channel_uart_tr_start(void *arg, struct mg_rpc_channel *ch) {
+  int uart_no = (intptr_t) arg;
+  mgos_uart_set_dispatcher(uart_no, mg_rpc_channel_uart_dispatcher, ch);
+  mgos_uart_set_rx_enabled(uart_no, true);
+}
+
+static void mg_rpc_channel_uart_tr_stop(void *arg) {
+  mgos_uart_set_dispatcher((intptr_t) arg, NULL, NULL);
+}
+
+static size_t mg_rpc_channel_uart_tr_read_avail(void *arg) {
+  return mgos_uart_read_avail((intptr_t) arg);
 }
 
+static size_t mg_rpc_channel_uart_tr_read(void *arg, struct mbuf *mb,
+                                          size_t len) {
+  return mgos_uart_read_mbuf((intptr_t) arg, mb, len);
+}
+
+static size_t mg_rpc_channel_uart_tr_write_avail(void *arg) {
+  return mgos_uart_write_avail((intptr_t) arg);
+}
+
+static size_t mg_rpc_channel_uart_tr_write(void *arg, const void *buf,
+                                           size_t len) {
+  return mgos_uart_write((intptr_t) arg, buf, len);
+}
+
+static void mg_rpc_channel_uart_tr_flush(void *arg) {
+  mgos_uart_flush((intptr_t) arg);
+}
+
+static void mg_rpc_channel_uart_tr_schedule(void *arg) {
+  mgos_uart_schedule_dispatcher((intptr_t) arg, false /* from_isr */);
+}
+
+static const struct mg_rpc_channel_uart_transport s_uart_transport = {
+    .name = "UART",
+    .start = mg_rpc_channel_uart_tr_start,
+    .stop = mg_rpc_channel_uart_tr_stop,
+    .read_avail = mg_rpc_channel_uart_tr_read_avail,
+    .read = mg_rpc_channel_uart_tr_read,
+    .write_avail = mg_rpc_channel_uart_tr_write_avail,
+    .write = mg_rpc_channel_uart_tr_write,
+    .flush = mg_rpc_channel_uart_tr_flush,
+    .schedule = mg_rpc_channel_uart_tr_schedule,
+};
+
 static void mg_rpc_channel_uart_ch_connect(struct mg_rpc_channel *ch) {
   struct mg_rpc_channel_uart_data *chd =
       (struct mg_rpc_channel_uart_data *) ch->channel_data;
+  if (chd->idle_timer_id == MGOS_INVALID_TIMER_ID) {
+    chd->idle_timer_id =
+        mgos_set_timer(BUF_IDLE_MS, MGOS_TIMER_REPEAT,
+                       mg_rpc_channel_uart_idle_timer_cb, chd);
+  }
   if (!chd->connected) {
     chd->waiting_for_start_frame = chd->wait_for_start_frame;
-    mgos_uart_set_dispatcher(chd->uart_no, mg_rpc_channel_uart_dispatcher, ch);
-    mgos_uart_set_rx_enabled(chd->uart_no, true);
+    chd->tr->start(chd->tr_arg, ch);
   }
 }
 
@@ -177,33 +802,68 @@ static bool mg_rpc_channel_uart_send_frame(struct mg_rpc_channel *ch,
                                            const struct mg_str f) {
   struct mg_rpc_channel_uart_data *chd =
       (struct mg_rpc_channel_uart_data *) ch->channel_data;
-  if (!chd->connected || chd->sending) return false;
+  /*
+   * Only one user frame at a time, but it may be queued behind probe replies
+   * and control frames, which are not followed by FRAME_SENT.
+   */
+  if (!chd->connected || chd->sending_user_frame || chd->user_frame_dropped) {
+    return false;
+  }
+  if (!mg_rpc_channel_uart_reserve(
+          chd, &chd->send_mbuf,
+          f.len + FRAME_CRC_LEN + 2 * FRAME_DELIMETER_LEN)) {
+    /*
+     * Returning false would look like "busy" and the frame would be retried
+     * forever. Take it and report it as failed from the dispatcher instead.
+     */
+    LOG(LL_ERROR, ("%p Out of memory sending frame (%d)", ch, (int) f.len));
+    if (chd->reconfig_wait_response &&
+        mg_rpc_channel_uart_is_response(f, chd->reconfig_id)) {
+      /* The peer won't see the response, keep the old settings. */
+      mg_rpc_channel_uart_reconfig_cancel(chd);
+    }
+    chd->user_frame_dropped = true;
+    chd->tr->schedule(chd->tr_arg);
+    return true;
+  }
   mbuf_append(&chd->send_mbuf, FRAME_DELIMETER, FRAME_DELIMETER_LEN);
   mbuf_append(&chd->send_mbuf, f.p, f.len);
+#if MG_RPC_CHANNEL_UART_CRC
   char crc_hex[9];
   sprintf(crc_hex, "%08x", (unsigned int) cs_crc32(0, f.p, f.len));
-  mbuf_append(&chd->send_mbuf, crc_hex, 8);
+  mbuf_append(&chd->send_mbuf, crc_hex, FRAME_CRC_LEN);
+#endif
   mbuf_append(&chd->send_mbuf, FRAME_DELIMETER, FRAME_DELIMETER_LEN);
   chd->sending = chd->sending_user_frame = true;
+  chd->user_frame_len = f.len;
+  chd->user_frame_end = chd->send_mbuf.len;
+  if (chd->reconfig_wait_response &&
+      mg_rpc_channel_uart_is_response(f, chd->reconfig_id)) {
+    chd->reconfig_wait_response = false;
+    chd->reconfig_on_sent = true;
+  }
 
   /* Disable UART console while sending. */
-  if (mgos_get_stdout_uart() == chd->uart_no ||
-      mgos_get_stderr_uart() == chd->uart_no) {
-    mgos_debug_suspend_uart();
-    chd->resume_uart = true;
-  } else {
-    chd->resume_uart = false;
-  }
+  mg_rpc_channel_uart_suspend_console(chd);
 
-  mgos_uart_schedule_dispatcher(chd->uart_no, false /* from_isr */);
+  chd->tr->schedule(chd->tr_arg);
   return true;
 }
 
 static void mg_rpc_channel_uart_ch_close(struct mg_rpc_channel *ch) {
   struct mg_rpc_channel_uart_data *chd =
       (struct mg_rpc_channel_uart_data *) ch->channel_data;
-  mgos_uart_set_dispatcher(chd->uart_no, NULL, NULL);
+  chd->tr->stop(chd->tr_arg);
+  mgos_clear_timer(chd->idle_timer_id);
+  chd->idle_timer_id = MGOS_INVALID_TIMER_ID;
+  mg_rpc_channel_uart_reconfig_cancel(chd);
   chd->connected = chd->sending = chd->sending_user_frame = false;
+  chd->user_frame_dropped = false;
+  chd->ctl_frame = NULL;
+  chd->ctl_off = 0;
+  chd->send_mbuf.len = chd->send_off = chd->frame_end = 0;
+  chd->last_handshake_reply_micros = 0;
+  mg_rpc_channel_uart_set_authn_info(ch, NULL);
   if (chd->resume_uart) mgos_debug_resume_uart();
   ch->ev_handler(ch, MG_RPC_CHANNEL_CLOSED, NULL);
 }
@@ -211,38 +871,83 @@ static void mg_rpc_channel_uart_ch_close(struct mg_rpc_channel *ch) {
 static void mg_rpc_channel_uart_ch_destroy(struct mg_rpc_channel *ch) {
   struct mg_rpc_channel_uart_data *chd =
       (struct mg_rpc_channel_uart_data *) ch->channel_data;
+  mgos_clear_timer(chd->idle_timer_id);
+  mgos_clear_timer(chd->reconfig_timer_id);
   mbuf_free(&chd->recv_mbuf);
   mbuf_free(&chd->send_mbuf);
+  free(chd->authn_username);
+  free(chd->cap.buf);
   free(chd);
   free(ch);
 }
 
 static const char *mg_rpc_channel_uart_get_type(struct mg_rpc_channel *ch) {
-  (void) ch;
-  return "UART";
+  struct mg_rpc_channel_uart_data *chd =
+      (struct mg_rpc_channel_uart_data *) ch->channel_data;
+  return chd->tr->name;
+}
+
+int64_t mg_rpc_channel_uart_get_idle_micros(struct mg_rpc_channel *ch) {
+  struct mg_rpc_channel_uart_data *chd =
+      (struct mg_rpc_channel_uart_data *) ch->channel_data;
+  if (ch->get_type != mg_rpc_channel_uart_get_type) return -1;
+  return mgos_uptime_micros() - chd->stats.last_rx_micros;
 }
 
 static bool mg_rpc_channel_uart_get_authn_info(
     struct mg_rpc_channel *ch, const char *auth_domain, const char *auth_file,
     struct mg_rpc_authn_info *authn) {
-  (void) ch;
+  struct mg_rpc_channel_uart_data *chd =
+      (struct mg_rpc_channel_uart_data *) ch->channel_data;
   (void) auth_domain;
   (void) auth_file;
-  (void) authn;
 
-  return false;
+  if (chd->authn_username == NULL) return false;
+  authn->username = mg_strdup(mg_mk_str(chd->authn_username));
+  return true;
+}
+
+bool mg_rpc_channel_uart_set_authn_info(struct mg_rpc_channel *ch,
+                                        const char *username) {
+  struct mg_rpc_channel_uart_data *chd =
+      (struct mg_rpc_channel_uart_data *) ch->channel_data;
+  if (ch->get_type != mg_rpc_channel_uart_get_type) return false;
+  free(chd->authn_username);
+  chd->authn_username = (username != NULL ? strdup(username) : NULL);
+  return (username == NULL || chd->authn_username != NULL);
 }
 
 static char *mg_rpc_channel_uart_get_info(struct mg_rpc_channel *ch) {
   struct mg_rpc_channel_uart_data *chd =
       (struct mg_rpc_channel_uart_data *) ch->channel_data;
-  char *res = NULL;
-  mg_asprintf(&res, 0, "UART%d", chd->uart_no);
+  char *res = NULL, id[16], ovf[24] = "";
+  const struct mg_rpc_channel_uart_stats *st = &chd->stats;
+  if (chd->uart_no >= 0) {
+    /* Bytes lost by the driver because the RX FIFO was not drained. */
+    const struct mgos_uart_stats *ust = mgos_uart_get_stats(chd->uart_no);
+    snprintf(id, sizeof(id), "UART%d", chd->uart_no);
+    if (ust != NULL) {
+      snprintf(ovf, sizeof(ovf), " rx_ovf %u",
+               (unsigned int) ust->rx_overflows);
+    }
+  } else {
+    snprintf(id, sizeof(id), "%s", chd->tr->name);
+  }
+  mg_asprintf(&res, 0,
+              "%s rx %u/%u tx %u/%u crc_err %u rx_drop %u%s idle %d "
+              "alloc_fail %u buf rx %u/%u tx %u/%u max_dispatch %u",
+              id, st->rx_frames, st->rx_bytes, st->tx_frames,
+              st->tx_bytes, st->rx_crc_errors, st->rx_drops, ovf,
+              (int) (mg_rpc_channel_uart_get_idle_micros(ch) / 1000),
+              st->alloc_failures, (unsigned int) chd->recv_mbuf.size,
+              st->rx_buf_peak, (unsigned int) chd->send_mbuf.size,
+              st->tx_buf_peak, st->max_dispatch_micros);
   return res;
 }
 
-struct mg_rpc_channel *mg_rpc_channel_uart(int uart_no,
-                                           bool wait_for_start_frame) {
+struct mg_rpc_channel *mg_rpc_channel_uart_with_transport(
+    const struct mg_rpc_channel_uart_transport *tr, void *tr_arg,
+    bool wait_for_start_frame) {
   struct mg_rpc_channel *ch = (struct mg_rpc_channel *) calloc(1, sizeof(*ch));
   ch->ch_connect = mg_rpc_channel_uart_ch_connect;
   ch->send_frame = mg_rpc_channel_uart_send_frame;
@@ -255,15 +960,142 @@ struct mg_rpc_channel *mg_rpc_channel_uart(int uart_no,
   ch->get_info = mg_rpc_channel_uart_get_info;
   struct mg_rpc_channel_uart_data *chd =
       (struct mg_rpc_channel_uart_data *) calloc(1, sizeof(*chd));
-  chd->uart_no = uart_no;
+  chd->uart_no = -1;
+  chd->tr = tr;
+  chd->tr_arg = tr_arg;
   chd->wait_for_start_frame = wait_for_start_frame;
   mbuf_init(&chd->recv_mbuf, 0);
   mbuf_init(&chd->send_mbuf, 0);
   ch->channel_data = chd;
+  return ch;
+}
+
+struct mg_rpc_channel *mg_rpc_channel_uart(int uart_no,
+                                           bool wait_for_start_frame) {
+  struct mg_rpc_channel *ch = mg_rpc_channel_uart_with_transport(
+      &s_uart_transport, (void *) (intptr_t) uart_no, wait_for_start_frame);
+  struct mg_rpc_channel_uart_data *chd =
+      (struct mg_rpc_channel_uart_data *) ch->channel_data;
+  chd->uart_no = uart_no;
   LOG(LL_INFO, ("%p UART%d", ch, uart_no));
   return ch;
 }
 
+static void mgos_rpc_uart_configure_handler(struct mg_rpc_request_info *ri,
+                                            void *cb_arg,
+                                            struct mg_rpc_frame_info *fi,
+                                            struct mg_str args) {
+  struct mg_rpc_channel *ch = (struct mg_rpc_channel *) cb_arg;
+  struct mg_rpc_channel_uart_data *chd =
+      (struct mg_rpc_channel_uart_data *) ch->channel_data;
+  struct mgos_uart_config ucfg;
+  int baud_rate = -1, fc_type = -1, rx_buf_size = -1, tx_buf_size = -1;
+  int rx_linger_micros = -1;
+
+  /*
+   * The switch is coordinated with the response sent over this UART,
+   * requests coming from elsewhere can't be handled safely.
+   */
+  if (fi->channel_type == NULL ||
+      strcmp(fi->channel_type, ch->get_type(ch)) != 0) {
+    mg_rpc_send_errorf(ri, 400, "must be called over UART%d", chd->uart_no);
+    return;
+  }
+  if (chd->reconfig_wait_response || chd->reconfig_on_sent ||
+      chd->reconfig_timer_id != MGOS_INVALID_TIMER_ID) {
+    mg_rpc_send_errorf(ri, 409, "reconfiguration in progress");
+    return;
+  }
+  if (!mgos_uart_config_get(chd->uart_no, &ucfg)) {
+    mg_rpc_send_errorf(ri, 500, "UART%d is not configured", chd->uart_no);
+    return;
+  }
+  json_scanf(args.p, args.len, ri->args_fmt, &baud_rate, &fc_type,
+             &rx_buf_size, &tx_buf_size, &rx_linger_micros);
+  if (baud_rate != -1 && (baud_rate < RECONFIG_MIN_BAUD_RATE ||
+                          baud_rate > RECONFIG_MAX_BAUD_RATE)) {
+    mg_rpc_send_errorf(ri, 400, "invalid baud_rate");
+    return;
+  }
+  if (fc_type != -1 && (fc_type < MGOS_UART_FC_NONE ||
+                        fc_type > MGOS_UART_FC_SW)) {
+    mg_rpc_send_errorf(ri, 400, "invalid fc_type");
+    return;
+  }
+  chd->old_cfg = ucfg;
+  if (baud_rate > 0) ucfg.baud_rate = baud_rate;
+  if (fc_type >= 0) {
+    ucfg.rx_fc_type = ucfg.tx_fc_type = (enum mgos_uart_fc_type) fc_type;
+  }
+  if (rx_buf_size > 0) ucfg.rx_buf_size = rx_buf_size;
+  if (tx_buf_size > 0) ucfg.tx_buf_size = tx_buf_size;
+  if (rx_linger_micros >= 0) ucfg.rx_linger_micros = rx_linger_micros;
+
+  /*
+   * New settings take effect once the response has been sent, so that the
+   * peer receives it with the old ones. send_frame recognizes the response
+   * by its id.
+   */
+  chd->new_cfg = ucfg;
+  chd->reconfig_id = ri->id;
+  chd->reconfig_wait_response = true;
+  mg_rpc_send_responsef(ri, NULL);
+}
+
+static void mgos_rpc_uart_get_capture_handler(struct mg_rpc_request_info *ri,
+                                              void *cb_arg,
+                                              struct mg_rpc_frame_info *fi,
+                                              struct mg_str args) {
+  struct mg_rpc_channel *ch = (struct mg_rpc_channel *) cb_arg;
+  struct mg_rpc_channel_uart_data *chd =
+      (struct mg_rpc_channel_uart_data *) ch->channel_data;
+  struct mg_rpc_channel_uart_capture *c = &chd->cap;
+  bool clear = false;
+  uint8_t *data = NULL;
+  size_t i, len = c->len;
+
+  if (c->size == 0) {
+    mg_rpc_send_errorf(ri, 400, "capture is disabled");
+    return;
+  }
+  json_scanf(args.p, args.len, ri->args_fmt, &clear);
+  /* Take a linear copy, sending the response adds records to the ring. */
+  data = (uint8_t *) malloc(len + 1);
+  if (data == NULL) {
+    mg_rpc_send_errorf(ri, 500, "out of memory");
+    return;
+  }
+  for (i = 0; i < len; i++) data[i] = c->buf[(c->start + i) % c->size];
+  if (clear) c->start = c->len = 0;
+  mg_rpc_send_responsef(ri, "{uptime: %lld, data: %V}",
+                        (long long) mgos_uptime_micros(), data, (int) len);
+  free(data);
+  (void) fi;
+}
+
+#if MG_RPC_CHANNEL_UART_TRACE
+static void mgos_rpc_uart_get_trace_handler(struct mg_rpc_request_info *ri,
+                                            void *cb_arg,
+                                            struct mg_rpc_frame_info *fi,
+                                            struct mg_str args) {
+  struct mbuf mb;
+  struct json_out out = JSON_OUT_MBUF(&mb);
+  mbuf_init(&mb, 0);
+  mg_rpc_channel_uart_trace_dump(&out);
+  mg_rpc_send_responsef(ri, "%.*s", (int) mb.len, mb.buf);
+  mbuf_free(&mb);
+  (void) cb_arg;
+  (void) fi;
+  (void) args;
+}
+#endif
+
+static struct mg_rpc_channel *s_uart_channel = NULL;
+
+struct mg_rpc_channel *mgos_rpc_uart_get_channel(void) {
+  return s_uart_channel;
+}
+
 bool mgos_rpc_uart_init(void) {
   const struct mgos_config_rpc *sccfg = mgos_sys_config_get_rpc();
   if (mgos_rpc_get_global() == NULL || sccfg->uart.uart_no < 0) return true;
@@ -282,11 +1114,40 @@ bool mgos_rpc_uart_init(void) {
     ucfg.rx_fc_type = ucfg.tx_fc_type =
         (enum mgos_uart_fc_type) scucfg->fc_type;
   }
+  if (scucfg->rx_linger_micros >= 0) {
+    ucfg.rx_linger_micros = scucfg->rx_linger_micros;
+  }
   if (mgos_uart_configure(scucfg->uart_no, &ucfg)) {
     struct mg_rpc_channel *uch =
         mg_rpc_channel_uart(scucfg->uart_no, scucfg->wait_for_start_frame);
+    struct mg_rpc_channel_uart_data *chd =
+        (struct mg_rpc_channel_uart_data *) uch->channel_data;
+    chd->max_frames_per_dispatch = scucfg->max_frames_per_dispatch;
+    if (scucfg->recv_buf_size > 0) {
+      chd->recv_buf_min_size = scucfg->recv_buf_size;
+      mbuf_resize(&chd->recv_mbuf, chd->recv_buf_min_size);
+    }
+    if (scucfg->send_buf_size > 0) {
+      chd->send_buf_min_size = scucfg->send_buf_size;
+      mbuf_resize(&chd->send_mbuf, chd->send_buf_min_size);
+    }
+    if (scucfg->capture_size > CAPTURE_HDR_LEN) {
+      chd->cap.buf = (uint8_t *) malloc(scucfg->capture_size);
+      if (chd->cap.buf != NULL) chd->cap.size = scucfg->capture_size;
+    }
     mg_rpc_add_channel(mgos_rpc_get_global(), mg_mk_str(""), uch);
+    s_uart_channel = uch;
     uch->ch_connect(uch);
+    mg_rpc_add_handler(mgos_rpc_get_global(), "RPC.UART.Configure",
+                       "{baud_rate: %d, fc_type: %d, rx_buf_size: %d, "
+                       "tx_buf_size: %d, rx_linger_micros: %d}",
+                       mgos_rpc_uart_configure_handler, uch);
+    mg_rpc_add_handler(mgos_rpc_get_global(), "RPC.UART.GetCapture",
+                       "{clear: %B}", mgos_rpc_uart_get_capture_handler, uch);
+#if MG_RPC_CHANNEL_UART_TRACE
+    mg_rpc_add_handler(mgos_rpc_get_global(), "RPC.UART.GetTrace", "",
+                       mgos_rpc_uart_get_trace_handler, NULL);
+#endif
   } else {
     LOG(LL_ERROR, ("UART%d init failed", scucfg->uart_no));
     return false;